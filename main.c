@@ -25,6 +25,10 @@
 #include "dma_buffer.h"
 
 #define MODBUS_SLAVE_ADDR 20
+#define MB_SAMPLE_FIFO	  0
+#define MB_CAL_FILE	  1
+/* Position in MODBUS_FORWARD_PORTS */
+#define RS485_PORT	  0
 
 static struct buf_s wr_buf;
 static volatile struct buf_s rd_buf;
@@ -46,12 +50,23 @@ uint8_t usb_read_ready(void) {
     return !buf_empty_switch(&wr_buf);
 }
 
+/* RS485_PutArray() only blocks if the previous frame is still queued */
+uint8_t rs485_tx_ready(void) {
+    return !RS485_GetTxBufferSize();
+}
+
 static uint16_t test_var;
 
-static int8_t modbus_write_regs(uint8_t *msg, uint8_t function) {
-    mb_data_init(msg, function);
+/* Process values, published with mb_image_write_begin()/end() by
+ * sample_isr(): the last sample, the number of samples dropped while the FIFO
+ * was full, and the 32 bit count of samples taken */
+static volatile uint16_t process_regs[MB_PROCESS_REGS];
+static struct mb_image_s process_image = {
+    process_regs, MB_PROCESS_REGS, 0
+};
 
-    if (mb_nr_regs > MAX_NR_REGS(_FC_WRITE_MULTIPLE_REGISTERS)) return -1;
+int8_t modbus_write_regs(uint8_t function, uint8_t *msg) {
+    mb_data_init(msg, function);
 
     while (mb_nr_regs) {
 	switch (mb_address) {
@@ -60,22 +75,21 @@ static int8_t modbus_write_regs(uint8_t *msg, uint8_t function) {
 		break;
 
 	    default:
-		return -1;
+		return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 	}
     }
 
     return MODBUS_WRITE_RESP_SIZE;
 }
 
-static int8_t modbus_read_regs(uint8_t *msg) {
-    mb_data_init(msg, _FC_READ_HOLDING_REGISTERS);
-
-    if (mb_nr_regs > MAX_NR_REGS(_FC_READ_HOLDING_REGISTERS)) return -1;
+int8_t modbus_read_regs(uint8_t function, uint8_t *msg) {
+    mb_data_init(msg, function);
 
     while (mb_nr_regs) {
 	switch (mb_address) {
 	    case MB_VERSION:
-		if (mb_nr_regs < MB_VERSION_REGS) return -1;
+		if (mb_nr_regs < MB_VERSION_REGS)
+		    return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 		mb_data_resp(msg, GIT_REVISION >> 16);
 		mb_data_resp(msg, GIT_REVISION);
 		break;
@@ -84,25 +98,75 @@ static int8_t modbus_read_regs(uint8_t *msg) {
 		mb_data_resp(msg, test_var);
 		break;
 
+	    /* Progress of a calibration table download */
+	    case MB_CAL_STATUS:
+		if (mb_nr_regs < MB_CAL_STATUS_REGS)
+		    return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+		mb_data_resp(msg, mb_files[MB_CAL_FILE - 1].next_record);
+		mb_data_resp(msg, MB_FILE_CRC(MB_CAL_FILE) >> 16);
+		mb_data_resp(msg, MB_FILE_CRC(MB_CAL_FILE));
+		mb_data_resp(msg, MB_FILE_STALE(MB_CAL_FILE));
+		break;
+
 	    default:
-		return -1;
+		if (mb_address >= MB_PROCESS &&
+			mb_address < MB_PROCESS + MB_PROCESS_REGS) {
+		    mb_image_resp(msg, &process_image, mb_address - MB_PROCESS);
+		    break;
+		}
+		return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
 	}
     }
 
     return mb_resp_bytes;
 }
 
-int8_t modbus_respond(uint8_t function, uint8_t *msg) {
-    switch (function) {
-        case _FC_WRITE_SINGLE_REGISTER:
-        case _FC_WRITE_MULTIPLE_REGISTERS:
-            return modbus_write_regs(msg, function);
-        case _FC_READ_HOLDING_REGISTERS:
-            return modbus_read_regs(msg);
-        case _FC_REPORT_SLAVE_ID:
-            return modbus_slave_id_response(msg);
-    }
-    return -1;
+static uint8_t cal_table[128];
+
+static uint8_t cal_file_valid(uint16_t file, uint16_t record, uint8_t nr) {
+    return file == MB_CAL_FILE && (record + nr) * 2 <= sizeof(cal_table);
+}
+
+int8_t cal_file_read(uint16_t file, uint16_t record, uint8_t *data,
+		uint8_t nr) {
+    if (!cal_file_valid(file, record, nr))
+	return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    memcpy(data, &cal_table[record * 2], nr * 2);
+    return 0;
+}
+
+int8_t cal_file_write(uint16_t file, uint16_t record, const uint8_t *data,
+		uint8_t nr) {
+    if (!cal_file_valid(file, record, nr))
+	return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    memcpy(&cal_table[record * 2], data, nr * 2);
+    return 0;
+}
+
+static struct mb_fifo_s sample_fifo;
+
+/* Runs at the rate of SAMPLE_TIMER. Samples are dropped, and counted, while
+ * the FIFO is full. */
+CY_ISR(sample_isr) {
+    static uint32_t samples = 0;
+    uint16_t sample = ADC_GetResult16();
+
+    samples++;
+    mb_image_write_begin(&process_image);
+    process_regs[0] = sample;
+    if (!mb_fifo_push(&sample_fifo, sample)) process_regs[1]++;
+    process_regs[2] = samples >> 16;
+    process_regs[3] = samples;
+    mb_image_write_end(&process_image);
+}
+
+int8_t modbus_read_fifo(uint8_t function, uint8_t *msg) {
+    (void) function;
+
+    if (MB_FIFO_ADDR(msg) != MB_SAMPLE_FIFO)
+	return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+    return mb_fifo_resp(msg, &sample_fifo);
 }
 
 CY_ISR(rs485_rx_isr) {
@@ -137,6 +201,9 @@ static void rs485_to_usb(void) {
 	dma_buf = buf_switch(&rd_buf, &bytes);
 
 	RS485_RX_ISR_Enable();
+
+	/* Ends the forwarded request once its response is complete */
+	if (bytes) modbus_port_rx(RS485_PORT, dma_buf, bytes);
     }
 
     if (bytes) {
@@ -154,6 +221,11 @@ int main() {
     RS485_RX_ISR_StartEx(rs485_rx_isr);
     BUTTON_ISR_StartEx(button_isr);
 
+    ADC_Start();
+    ADC_StartConvert();
+    SAMPLE_TIMER_Start();
+    SAMPLE_ISR_StartEx(sample_isr);
+
     modbus_init(MODBUS_SLAVE_ADDR);
     modbus_tx_led(STATUS_LED_0_Write, MODBUS_ACTIVE_HIGH);
     modbus_rx_led(STATUS_LED_1_Write, MODBUS_ACTIVE_HIGH);
@@ -24,12 +24,79 @@
 #define MODBUS_USE_FUNCTION_POINTERS	0
 #define MODBUS_FORWARD_PACKETS		1
 
+/* Set when the RS485 transceiver has no automatic direction control. The
+ * port layer then drives the driver enable line, and releases it
+ * MODBUS_RS485_DE_GUARD_US after the stop bit of the last byte. On PSoC the
+ * guard time is the period of RS485_DE_TIMER, which is only used when this is
+ * non-zero. */
+#define MODBUS_RS485_DE_CONTROL		0
+#define MODBUS_RS485_DE_GUARD_US	0
+
 #define MODBUS_WRITE_FUNC	USBFS_PutData
+/* Optional. When given, MODBUS_WRITE_FUNC may return before the reply has
+ * been sent, and the next reply is held until this returns non-zero. */
+#define MODBUS_WRITE_READY_FUNC	USBFS_CDCIsReady
+/* Set instead when the port calls modbus_tx_complete() itself, for example
+ * from a DMA or endpoint interrupt. Either way a request that arrives while the
+ * previous reply is being sent is held for up to the hold timeout. */
+#define MODBUS_TX_COMPLETE_CALLBACK	0
 #define MODBUS_READ_READY_FUNC	usb_read_ready
 #define MODBUS_READ_FUNC	usb_get_byte
-#define MODBUS_PROCESS_FUNC	modbus_respond
-#define MODBUS_FORWARD_FUNC	RS485_PutArray
+
+/* Outbound interfaces for forwarded requests, as X(write, ready), numbered
+ * from 0 in the order given. ready returns non-zero once the interface can
+ * take another frame, and may be NULL for an interface that always can.
+ * write must not block, so the RS485 transmit buffer holds at least
+ * MODBUS_MAX_PACKET_LENGTH bytes. The next request is only written once the
+ * previous one has been answered, as seen by modbus_port_rx(), or has timed
+ * out. Requests for a busy interface are held in a queue of
+ * MODBUS_FORWARD_QUEUE frames per interface. */
+#if MODBUS_RS485_DE_CONTROL
+#define MODBUS_FORWARD_PORTS(X)	X(modbus_rs485_put_array, modbus_rs485_ready)
+#else
+#define MODBUS_FORWARD_PORTS(X)	X(RS485_PutArray, rs485_tx_ready)
+#endif
+#define MODBUS_FORWARD_QUEUE	1
+#define MODBUS_RESPONSE_TIMEOUT_MS	200
+#define MODBUS_TURNAROUND_MS		100
+#define MODBUS_PORT_SILENCE_MS		10
+
+/* Function codes served by this slave and the handler for each. Requests
+ * for any other function code are rejected with an illegal function exception
+ * before reaching the application. */
+#define MODBUS_READ_HOLDING_REGISTERS_FUNC	modbus_read_regs
+#define MODBUS_WRITE_SINGLE_REGISTER_FUNC	modbus_write_regs
+#define MODBUS_WRITE_MULTIPLE_REGISTERS_FUNC	modbus_write_regs
+#define MODBUS_REPORT_SLAVE_ID_FUNC		modbus_slave_id_response
+#define MODBUS_READ_FIFO_QUEUE_FUNC		modbus_read_fifo
+#define MODBUS_READ_FILE_RECORD_FUNC		modbus_read_file_record
+#define MODBUS_WRITE_FILE_RECORD_FUNC		modbus_write_file_record
+
+/* Data for the file record handlers, and the number of files to track */
+#define MODBUS_FILE_SOURCE_FUNC	cal_file_read
+#define MODBUS_FILE_SINK_FUNC	cal_file_write
+#define MODBUS_FILES		1
+
+/* Holding registers implemented by this slave, as X(start, count). Requests
+ * outside these ranges are answered with an illegal data address exception
+ * before reaching the handler. A map may also be given for
+ * MODBUS_COIL_MAP, MODBUS_DISCRETE_INPUT_MAP and MODBUS_INPUT_REG_MAP. */
+#define MB_PROCESS		0x10
+#define MB_PROCESS_REGS		4
+#define MB_CAL_STATUS		0x20
+#define MB_CAL_STATUS_REGS	4
+#define MODBUS_HOLDING_REG_MAP(X)	X(0, 1) X(MB_VERSION, MB_VERSION_REGS) \
+					X(MB_PROCESS, MB_PROCESS_REGS)	    \
+					X(MB_CAL_STATUS, MB_CAL_STATUS_REGS)
 
 uint8_t usb_read_ready(void);
 uint8_t usb_get_byte(void);
+uint8_t rs485_tx_ready(void);
+int8_t modbus_read_regs(uint8_t function, uint8_t *msg);
+int8_t modbus_write_regs(uint8_t function, uint8_t *msg);
+int8_t modbus_read_fifo(uint8_t function, uint8_t *msg);
+int8_t cal_file_read(uint16_t file, uint16_t record, uint8_t *data,
+		uint8_t nr);
+int8_t cal_file_write(uint16_t file, uint16_t record, const uint8_t *data,
+		uint8_t nr);
 
@@ -0,0 +1,180 @@
+/* Copyright (C) 2016 Kim Taylor
+ *
+ * This module holds non-portable code for the Modbus library, for hosts with
+ * a POSIX serial port. Build with MODBUS_POSIX defined.
+ *
+ * hbc_mac is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * hbc_mac is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with hbc_mac.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
+
+#ifndef MODBUS_TIMEOUT_MS
+#define MODBUS_TIMEOUT_MS 50
+#endif
+#ifndef MODBUS_HOLD_TIMEOUT_MS
+#define MODBUS_HOLD_TIMEOUT_MS 1000
+#endif
+
+static void _modbus_deadline(struct timespec *expiry, long ms) {
+    clock_gettime(CLOCK_MONOTONIC, expiry);
+    expiry->tv_nsec += ms * 1000000L;
+    expiry->tv_sec += expiry->tv_nsec / 1000000000L;
+    expiry->tv_nsec %= 1000000000L;
+}
+
+static uint8_t _modbus_deadline_passed(const struct timespec *expiry) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec != expiry->tv_sec) return now.tv_sec > expiry->tv_sec;
+    return now.tv_nsec >= expiry->tv_nsec;
+}
+
+static struct timespec _modbus_timer_expiry;
+static uint8_t _modbus_timer_running = 0;
+#define _modbus_timer_finished \
+	(_modbus_timer_running && _modbus_deadline_passed(&_modbus_timer_expiry))
+
+void _modbus_timer_stop_and_reset(void) {
+    _modbus_timer_running = 0;
+}
+
+void _modbus_timer_start(void) {
+    _modbus_deadline(&_modbus_timer_expiry, MODBUS_TIMEOUT_MS);
+    _modbus_timer_running = 1;
+}
+
+void _modbus_timer_init(void) {
+    _modbus_timer_running = 0;
+}
+
+#if MODBUS_TX_ASYNC
+static struct timespec _modbus_hold_timer_expiry;
+static uint8_t _modbus_hold_timer_running = 0;
+#define _modbus_hold_timer_finished (_modbus_hold_timer_running && \
+	_modbus_deadline_passed(&_modbus_hold_timer_expiry))
+
+void _modbus_hold_timer_stop_and_reset(void) {
+    _modbus_hold_timer_running = 0;
+}
+
+void _modbus_hold_timer_start(void) {
+    _modbus_deadline(&_modbus_hold_timer_expiry, MODBUS_HOLD_TIMEOUT_MS);
+    _modbus_hold_timer_running = 1;
+}
+
+void _modbus_hold_timer_init(void) {
+    _modbus_hold_timer_running = 0;
+}
+#endif
+
+#if MODBUS_FORWARD_PACKETS
+static struct timespec _modbus_port_expiry[NR_PORTS];
+static uint8_t _modbus_port_running[NR_PORTS];
+#define _modbus_port_timer_finished(port) (_modbus_port_running[port] && \
+	_modbus_deadline_passed(&_modbus_port_expiry[port]))
+
+void _modbus_port_timer_start(uint8_t port, uint16_t ms) {
+    _modbus_deadline(&_modbus_port_expiry[port], ms);
+    _modbus_port_running[port] = 1;
+}
+
+void _modbus_port_timer_stop(uint8_t port) {
+    _modbus_port_running[port] = 0;
+}
+
+void _modbus_port_timer_init(void) {
+}
+#endif
+
+#if MODBUS_RS485_DE_CONTROL
+/* The serial port that modbus_rs485_put_array() writes to. Must be set by the
+ * application before modbus_init(), and left in blocking mode. RTS drives the
+ * driver enable line. */
+int modbus_rs485_fd = -1;
+/* errno from the last write that failed, which drops the frame */
+int modbus_rs485_error = 0;
+static uint8_t _modbus_rs485_kernel_de = 0;
+
+static void _modbus_rs485_de(int enable) {
+    int rts = TIOCM_RTS;
+    ioctl(modbus_rs485_fd, enable ? TIOCMBIS : TIOCMBIC, &rts);
+}
+
+static void _modbus_rs485_write(const uint8_t *msg, uint8_t bytes) {
+    ssize_t written;
+
+    while (bytes) {
+	written = write(modbus_rs485_fd, msg, bytes);
+	if (written < 0) {
+	    if (errno == EINTR) continue;
+	    modbus_rs485_error = errno;
+	    return;
+	}
+	msg += written;
+	bytes -= written;
+    }
+}
+
+/* The driver is enabled just before the first byte is written, and released
+ * once tcdrain() reports that the last byte has left the port. Where the
+ * kernel supports RS485 mode it switches the line itself, from the UART's
+ * transmit complete interrupt. */
+void modbus_rs485_put_array(const uint8_t *msg, uint8_t bytes) {
+#if MODBUS_RS485_DE_GUARD_US
+    struct timespec guard = {0, MODBUS_RS485_DE_GUARD_US * 1000L};
+#endif
+
+    if (_modbus_rs485_kernel_de) {
+	_modbus_rs485_write(msg, bytes);
+	return;
+    }
+
+    _modbus_rs485_de(1);
+    _modbus_rs485_write(msg, bytes);
+    tcdrain(modbus_rs485_fd);
+#if MODBUS_RS485_DE_GUARD_US
+    nanosleep(&guard, NULL);
+#endif
+    _modbus_rs485_de(0);
+}
+
+/* modbus_rs485_put_array() returns once the bus has been released */
+uint8_t modbus_rs485_ready(void) {
+    return 1;
+}
+
+void _modbus_rs485_init(void) {
+#ifdef TIOCSRS485
+    struct serial_rs485 rs485;
+
+    memset(&rs485, 0, sizeof(rs485));
+    rs485.flags = SER_RS485_ENABLED | SER_RS485_RTS_ON_SEND;
+    /* The kernel only offers millisecond resolution */
+    rs485.delay_rts_after_send = (MODBUS_RS485_DE_GUARD_US + 999) / 1000;
+    if (!ioctl(modbus_rs485_fd, TIOCSRS485, &rs485)) {
+	_modbus_rs485_kernel_de = 1;
+	return;
+    }
+#endif
+    _modbus_rs485_de(0);
+}
+#endif
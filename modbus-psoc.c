@@ -37,3 +37,148 @@ void _modbus_timer_init(void) {
     MODBUS_TIMER_Init();
     MODBUS_TIMEOUT_StartEx(modbus_timeout);
 }
+
+#if MODBUS_TX_ASYNC
+/* Bounds how long a request is held for the transmitter. MODBUS_HOLD_TIMER is
+ * configured like MODBUS_TIMER, with its period set to the hold timeout. */
+static volatile uint8_t _modbus_hold_timer_finished = 0;
+
+CY_ISR(modbus_hold_timeout) {
+    _modbus_hold_timer_finished = 1;
+}
+
+void _modbus_hold_timer_stop_and_reset(void) {
+    MODBUS_HOLD_TIMER_Stop();
+    MODBUS_HOLD_TIMER_RESET_Write(1);
+    _modbus_hold_timer_finished = 0;
+}
+
+void _modbus_hold_timer_start(void) {
+    MODBUS_HOLD_TIMER_Enable();
+}
+
+void _modbus_hold_timer_init(void) {
+    MODBUS_HOLD_TIMER_Init();
+    MODBUS_HOLD_TIMEOUT_StartEx(modbus_hold_timeout);
+}
+#endif
+
+#if MODBUS_FORWARD_PACKETS
+/* Response timers for the forwarding interfaces, counted down by
+ * MODBUS_PORT_TICK, an interrupt at 1 kHz */
+static volatile uint16_t _modbus_port_ms[NR_PORTS];
+static volatile uint8_t _modbus_port_expired[NR_PORTS];
+#define _modbus_port_timer_finished(port) (_modbus_port_expired[port])
+
+CY_ISR(modbus_port_tick) {
+    uint8_t port;
+
+    for (port = 0; port < NR_PORTS; port++) {
+	if (_modbus_port_ms[port] && !--_modbus_port_ms[port])
+	    _modbus_port_expired[port] = 1;
+    }
+}
+
+/* The count cannot be written atomically on the 8051 */
+void _modbus_port_timer_start(uint8_t port, uint16_t ms) {
+    MODBUS_PORT_TICK_Disable();
+    _modbus_port_ms[port] = ms;
+    _modbus_port_expired[port] = 0;
+    MODBUS_PORT_TICK_Enable();
+}
+
+void _modbus_port_timer_stop(uint8_t port) {
+    _modbus_port_timer_start(port, 0);
+}
+
+void _modbus_port_timer_init(void) {
+    MODBUS_PORT_TICK_StartEx(modbus_port_tick);
+}
+#endif
+
+#if MODBUS_RS485_DE_CONTROL
+/* For transceivers without automatic direction control. The driver is enabled
+ * just before the first byte is queued, and released once the stop bit of the
+ * last byte has left the shift register, plus the guard time.
+ *
+ * COMPLETE is set as each byte finishes, and the FIFO empties as the last
+ * byte moves into the shift register, which is when the byte before it
+ * finishes. So the first interrupt that finds the FIFO and buffer empty only
+ * clears the status, and the driver is released on the COMPLETE after that.
+ * This relies on the TX interrupt being serviced within one character time.
+ *
+ * The UART needs a TX buffer of at least MODBUS_MAX_PACKET_LENGTH bytes, so
+ * that RS485_PutArray() never waits and the component's own TX interrupt
+ * refills the FIFO. Reading the TX status clears it, so the completion is
+ * taken from that interrupt rather than from a second one on tx_interrupt:
+ * cyapicallbacks.h must define RS485_TXISR_EXIT_CALLBACK. The guard time is
+ * the period of RS485_DE_TIMER, a one shot timer configured like MODBUS_TIMER
+ * with RS485_DE_TIMEOUT on its interrupt. */
+#define _DE_IDLE	0
+#define _DE_SENDING	1
+#define _DE_LAST_BYTE	2   /* The last byte is in the shift register */
+#define _DE_GUARD	3
+static volatile uint8_t _modbus_rs485_de = _DE_IDLE;
+
+static void modbus_rs485_release(void) {
+    RS485_DE_Write(0);
+    _modbus_rs485_de = _DE_IDLE;
+}
+
+#if MODBUS_RS485_DE_GUARD_US
+CY_ISR(modbus_rs485_guard_done) {
+    RS485_DE_TIMER_Stop();
+    RS485_DE_TIMER_RESET_Write(1);
+    modbus_rs485_release();
+}
+#endif
+
+void RS485_TXISR_ExitCallback(void) {
+    uint8_t status;
+
+    if (_modbus_rs485_de != _DE_SENDING &&
+		    _modbus_rs485_de != _DE_LAST_BYTE) return;
+    /* Reading the status clears COMPLETE */
+    status = RS485_ReadTxStatus();
+
+    if (_modbus_rs485_de == _DE_SENDING) {
+	if ((status & RS485_TX_STS_FIFO_EMPTY) && !RS485_GetTxBufferSize())
+	    _modbus_rs485_de = _DE_LAST_BYTE;
+	return;
+    }
+
+    if (!(status & RS485_TX_STS_COMPLETE)) return;
+#if MODBUS_RS485_DE_GUARD_US
+    _modbus_rs485_de = _DE_GUARD;
+    RS485_DE_TIMER_Enable();
+#else
+    modbus_rs485_release();
+#endif
+}
+
+void modbus_rs485_put_array(const uint8_t *msg, uint8_t bytes) {
+    uint8 intr;
+
+    /* Hold off the TX interrupt until these bytes are queued */
+    intr = CyEnterCriticalSection();
+    RS485_DE_Write(1);
+    _modbus_rs485_de = _DE_SENDING;
+    RS485_PutArray(msg, bytes);
+    CyExitCriticalSection(intr);
+}
+
+/* The bus is free once the driver has been released */
+uint8_t modbus_rs485_ready(void) {
+    return _modbus_rs485_de == _DE_IDLE;
+}
+
+void _modbus_rs485_init(void) {
+    RS485_DE_Write(0);
+    /* Added to the FIFO interrupts that the TX buffer already relies on */
+    RS485_SetTxInterruptMode(RS485_TXSTATUS_MASK_REG | RS485_TX_STS_COMPLETE);
+#if MODBUS_RS485_DE_GUARD_US
+    RS485_DE_TIMER_Init();
+    RS485_DE_TIMEOUT_StartEx(modbus_rs485_guard_done);
+#endif
+}
+#endif
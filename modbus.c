@@ -17,35 +17,70 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#ifdef MODBUS_POSIX
+/* For clock_gettime() and nanosleep() in modbus-posix.c */
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
+#include <string.h>
+#define CYCODE
+#else
 #include <project.h>
-
 #include "stdint.h"
+#endif
+
 #include "modbus-local.h"
 #include "modbus.h"
 
 static uint8_t modbus_msg[MODBUS_MAX_PACKET_LENGTH];
+/* Replies are built and transmitted from here, so that reception of the next
+ * request into modbus_msg can overlap transmission */
+static uint8_t modbus_tx_msg[MODBUS_MAX_PACKET_LENGTH];
+static volatile uint8_t _modbus_tx_busy;
 #if MODBUS_USE_FUNCTION_POINTERS
 static modbus_write_t	    _modbus_write;
+static modbus_write_ready_t _modbus_write_ready;
 static modbus_read_ready_t  _modbus_read_ready;
 static modbus_read_t	    _modbus_read;
-static modbus_process_t	    _modbus_process;
-static modbus_forward_t	    _modbus_forward;
 #else
 #define _modbus_write	    MODBUS_WRITE_FUNC
+#ifdef MODBUS_WRITE_READY_FUNC
+#define _modbus_write_ready MODBUS_WRITE_READY_FUNC
+#endif
 #define _modbus_read_ready  MODBUS_READ_READY_FUNC
 #define _modbus_read	    MODBUS_READ_FUNC
-#define _modbus_process	    MODBUS_PROCESS_FUNC
-#define _modbus_forward	    MODBUS_FORWARD_FUNC
-int8_t _modbus_process(uint8_t function, uint8_t *msg);
 #endif
 
+/* Set when a reply may still be in progress after MODBUS_WRITE_FUNC returns */
+#if MODBUS_TX_COMPLETE_CALLBACK || MODBUS_USE_FUNCTION_POINTERS || \
+		defined(MODBUS_WRITE_READY_FUNC)
+#define MODBUS_TX_ASYNC 1
+/* A request for this device that arrived while the previous reply was still
+ * being sent. Reception carries on into modbus_msg in the meantime. */
+static uint8_t modbus_held_msg[MODBUS_MAX_PACKET_LENGTH];
+static uint8_t _modbus_held_bytes;
+static uint8_t _modbus_held_exception;
+#else
+#define MODBUS_TX_ASYNC 0
+#endif
+
+#if MODBUS_FORWARD_PACKETS
+#define _PORT_COUNT(write, ready)	+ 1
+#define NR_PORTS (0 MODBUS_FORWARD_PORTS(_PORT_COUNT))
+#endif
+
+#ifdef MODBUS_POSIX
+#include "modbus-posix.c"
+#else
 #include "modbus-psoc.c"
+#endif
 
 static void (*_tx_led_enable)(uint8_t val) = NULL;
 static void (*_rx_led_enable)(uint8_t val) = NULL;
 static uint8_t _tx_led_enable_val;
 static uint8_t _rx_led_enable_val;
-static uint8_t _slave_addr;
+/* Bitmap of the unit IDs answered by this device */
+static uint8_t _slave_addrs[32];
+#define SLAVE_ADDR_OWNED(addr) (_slave_addrs[(addr) >> 3] & 1 << ((addr) & 7))
 
 #define CRC16_POLY 0xA001
 #define CRC16_INIT 0xFFFF
@@ -68,6 +103,24 @@ static uint16_t crc16_update(uint16_t crc, uint8_t _data) {
     return crc;
 }
 
+#if MODBUS_FILES
+#define CRC32_POLY 0xEDB88320UL
+#define CRC32_INIT 0xFFFFFFFFUL
+
+static uint32_t crc32_bytes(uint32_t crc, const uint8_t *_data, uint8_t bytes) {
+    uint8_t i;
+
+    while (bytes--) {
+	crc ^= *(_data++);
+	for (i = 0; i < 8; i++) {
+	    if (crc & 1) crc = (crc >> 1) ^ CRC32_POLY;
+	    else crc >>= 1;
+	}
+    }
+    return crc;
+}
+#endif
+
 static uint16_t crc16_bytes(uint8_t *_data, uint8_t bytes) {
     uint16_t crc = CRC16_INIT;
     while (bytes--) {
@@ -90,103 +143,594 @@ typedef enum {
     MSG_CONFIRMATION,
 } msg_type_t;
 
+/* Framing descriptor for each function code. Both message types are packed
+ * into the same entry:
+ * meta:  bits 0-3 indication meta length, bits 4-7 confirmation meta length
+ * count: bits 0-3 indication byte count offset, bits 4-6 confirmation byte
+ *        count offset, bit 7 FC_BROADCAST if the indication may be broadcast.
+ *        An offset of 0 means there is no data after the meta.
+ * Exception responses (function | MODBUS_EXCEPTION) carry a single byte of
+ * meta, which is the default entry. */
+typedef struct {
+    uint8_t meta;
+    uint8_t count;
+} _fc_desc_t;
+
+#define FC_BROADCAST	0x80
+#define FC_DESC(ind_meta, ind_count, conf_meta, conf_count, flags)	    \
+	{ (ind_meta) | (conf_meta) << 4,				    \
+	  (ind_count) | (conf_count) << 4 | (flags) }
+#define FC_NONE		FC_DESC(0, 0, 1, 0, 0)
+#define FC_NONE_X8	FC_NONE, FC_NONE, FC_NONE, FC_NONE,		    \
+			FC_NONE, FC_NONE, FC_NONE, FC_NONE
+#define FC_NONE_X32	FC_NONE_X8, FC_NONE_X8, FC_NONE_X8, FC_NONE_X8
+#define FC_NONE_X128	FC_NONE_X32, FC_NONE_X32, FC_NONE_X32, FC_NONE_X32
+
+#define FC_IND_META(desc)	((desc).meta & 0x0f)
+#define FC_CONF_META(desc)	((desc).meta >> 4)
+#define FC_IND_COUNT(desc)	((desc).count & 0x0f)
+#define FC_CONF_COUNT(desc)	((desc).count >> 4 & 0x07)
+/* Set for entries left at FC_NONE, whose framing is not known */
+#define FC_UNKNOWN(desc)	((desc).meta == 1 << 4 && !(desc).count)
+
+/* Indexed by every possible function code, so that no range check is needed
+ * on the received byte */
+static const _fc_desc_t CYCODE _modbus_fc_desc[256] = {
+    FC_NONE,					/* 0x00 */
+    FC_DESC(4, 0, 1, 2, 0),			/* _FC_READ_COILS */
+    FC_DESC(4, 0, 1, 2, 0),			/* _FC_READ_DISCRETE_INPUTS */
+    FC_DESC(4, 0, 1, 2, 0),			/* _FC_READ_HOLDING_REGISTERS */
+    FC_DESC(4, 0, 1, 2, 0),			/* _FC_READ_INPUT_REGISTERS */
+    FC_DESC(4, 0, 4, 0, FC_BROADCAST),		/* _FC_WRITE_SINGLE_COIL */
+    FC_DESC(4, 0, 4, 0, FC_BROADCAST),		/* _FC_WRITE_SINGLE_REGISTER */
+    FC_NONE,					/* _FC_READ_EXCEPTION_STATUS */
+    FC_NONE, FC_NONE, FC_NONE, FC_NONE,		/* 0x08 - 0x0B */
+    FC_NONE, FC_NONE, FC_NONE,			/* 0x0C - 0x0E */
+    FC_DESC(5, 6, 4, 0, FC_BROADCAST),		/* _FC_WRITE_MULTIPLE_COILS */
+    FC_DESC(5, 6, 4, 0, FC_BROADCAST),		/* _FC_WRITE_MULTIPLE_REGISTERS */
+    FC_DESC(0, 0, 1, 2, 0),			/* _FC_REPORT_SLAVE_ID */
+    FC_NONE, FC_NONE,				/* 0x12 - 0x13 */
+    FC_DESC(1, 2, 1, 2, 0),			/* _FC_READ_FILE_RECORD */
+    FC_DESC(1, 2, 1, 2, FC_BROADCAST),		/* _FC_WRITE_FILE_RECORD */
+    FC_DESC(6, 0, 6, 0, FC_BROADCAST),		/* _FC_MASK_WRITE_REGISTER */
+    FC_DESC(9, 10, 1, 2, 0),			/* _FC_WRITE_AND_READ_REGISTERS */
+    FC_DESC(2, 0, 2, 3, 0),			/* _FC_READ_FIFO_QUEUE */
+    FC_NONE, FC_NONE, FC_NONE, FC_NONE,		/* 0x19 - 0x1C */
+    FC_NONE, FC_NONE, FC_NONE,			/* 0x1D - 0x1F */
+    FC_NONE_X32, FC_NONE_X32, FC_NONE_X32,	/* 0x20 - 0x7F */
+    FC_NONE_X128,				/* Exception responses */
+};
+
+/* Handlers for the function codes enabled in modbus-local.h. HAS_ is set for
+ * each one configured, so that code for the others can be left out. */
+#ifdef MODBUS_READ_COILS_FUNC
+#define HAS_READ_COILS	1
+#else
+#define HAS_READ_COILS	0
+#define MODBUS_READ_COILS_FUNC			NULL
+#endif
+#ifdef MODBUS_READ_DISCRETE_INPUTS_FUNC
+#define HAS_READ_DISCRETE_INPUTS	1
+#else
+#define HAS_READ_DISCRETE_INPUTS	0
+#define MODBUS_READ_DISCRETE_INPUTS_FUNC	NULL
+#endif
+#ifdef MODBUS_READ_HOLDING_REGISTERS_FUNC
+#define HAS_READ_HOLDING_REGISTERS	1
+#else
+#define HAS_READ_HOLDING_REGISTERS	0
+#define MODBUS_READ_HOLDING_REGISTERS_FUNC	NULL
+#endif
+#ifdef MODBUS_READ_INPUT_REGISTERS_FUNC
+#define HAS_READ_INPUT_REGISTERS	1
+#else
+#define HAS_READ_INPUT_REGISTERS	0
+#define MODBUS_READ_INPUT_REGISTERS_FUNC	NULL
+#endif
+#ifdef MODBUS_WRITE_SINGLE_COIL_FUNC
+#define HAS_WRITE_SINGLE_COIL	1
+#else
+#define HAS_WRITE_SINGLE_COIL	0
+#define MODBUS_WRITE_SINGLE_COIL_FUNC		NULL
+#endif
+#ifdef MODBUS_WRITE_SINGLE_REGISTER_FUNC
+#define HAS_WRITE_SINGLE_REGISTER	1
+#else
+#define HAS_WRITE_SINGLE_REGISTER	0
+#define MODBUS_WRITE_SINGLE_REGISTER_FUNC	NULL
+#endif
+#ifdef MODBUS_READ_EXCEPTION_STATUS_FUNC
+#define HAS_READ_EXCEPTION_STATUS	1
+#else
+#define HAS_READ_EXCEPTION_STATUS	0
+#define MODBUS_READ_EXCEPTION_STATUS_FUNC	NULL
+#endif
+#ifdef MODBUS_WRITE_MULTIPLE_COILS_FUNC
+#define HAS_WRITE_MULTIPLE_COILS	1
+#else
+#define HAS_WRITE_MULTIPLE_COILS	0
+#define MODBUS_WRITE_MULTIPLE_COILS_FUNC	NULL
+#endif
+#ifdef MODBUS_WRITE_MULTIPLE_REGISTERS_FUNC
+#define HAS_WRITE_MULTIPLE_REGISTERS	1
+#else
+#define HAS_WRITE_MULTIPLE_REGISTERS	0
+#define MODBUS_WRITE_MULTIPLE_REGISTERS_FUNC	NULL
+#endif
+#ifdef MODBUS_REPORT_SLAVE_ID_FUNC
+#define HAS_REPORT_SLAVE_ID	1
+#else
+#define HAS_REPORT_SLAVE_ID	0
+#define MODBUS_REPORT_SLAVE_ID_FUNC		NULL
+#endif
+#ifdef MODBUS_READ_FILE_RECORD_FUNC
+#define HAS_READ_FILE_RECORD	1
+#else
+#define HAS_READ_FILE_RECORD	0
+#define MODBUS_READ_FILE_RECORD_FUNC		NULL
+#endif
+#ifdef MODBUS_WRITE_FILE_RECORD_FUNC
+#define HAS_WRITE_FILE_RECORD	1
+#else
+#define HAS_WRITE_FILE_RECORD	0
+#define MODBUS_WRITE_FILE_RECORD_FUNC		NULL
+#endif
+#ifdef MODBUS_MASK_WRITE_REGISTER_FUNC
+#define HAS_MASK_WRITE_REGISTER	1
+#else
+#define HAS_MASK_WRITE_REGISTER	0
+#define MODBUS_MASK_WRITE_REGISTER_FUNC		NULL
+#endif
+#ifdef MODBUS_WRITE_AND_READ_REGISTERS_FUNC
+#define HAS_WRITE_AND_READ_REGISTERS	1
+#else
+#define HAS_WRITE_AND_READ_REGISTERS	0
+#define MODBUS_WRITE_AND_READ_REGISTERS_FUNC	NULL
+#endif
+#ifdef MODBUS_READ_FIFO_QUEUE_FUNC
+#define HAS_READ_FIFO_QUEUE	1
+#else
+#define HAS_READ_FIFO_QUEUE	0
+#define MODBUS_READ_FIFO_QUEUE_FUNC		NULL
+#endif
+
+#define _FC_MAX _FC_READ_FIFO_QUEUE
+
+static const modbus_process_t CYCODE _modbus_handlers[_FC_MAX + 1] = {
+    NULL,
+    MODBUS_READ_COILS_FUNC,
+    MODBUS_READ_DISCRETE_INPUTS_FUNC,
+    MODBUS_READ_HOLDING_REGISTERS_FUNC,
+    MODBUS_READ_INPUT_REGISTERS_FUNC,
+    MODBUS_WRITE_SINGLE_COIL_FUNC,
+    MODBUS_WRITE_SINGLE_REGISTER_FUNC,
+    MODBUS_READ_EXCEPTION_STATUS_FUNC,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    MODBUS_WRITE_MULTIPLE_COILS_FUNC,
+    MODBUS_WRITE_MULTIPLE_REGISTERS_FUNC,
+    MODBUS_REPORT_SLAVE_ID_FUNC,
+    NULL, NULL,
+    MODBUS_READ_FILE_RECORD_FUNC,
+    MODBUS_WRITE_FILE_RECORD_FUNC,
+    MODBUS_MASK_WRITE_REGISTER_FUNC,
+    MODBUS_WRITE_AND_READ_REGISTERS_FUNC,
+    MODBUS_READ_FIFO_QUEUE_FUNC,
+};
+
 static uint8_t compute_meta_length_after_function(
                 uint8_t function, msg_type_t msg_type) {
-    uint8_t length;
-
-    if (msg_type == MSG_INDICATION) {
-        if (function <= _FC_WRITE_SINGLE_REGISTER) {
-            length = 4;
-        } else if (function == _FC_WRITE_MULTIPLE_COILS ||
-                   function == _FC_WRITE_MULTIPLE_REGISTERS) {
-            length = 5;
-        } else if (function == _FC_MASK_WRITE_REGISTER) {
-            length = 6;
-        } else if (function == _FC_WRITE_AND_READ_REGISTERS) {
-            length = 9;
-        } else {
-            /* _FC_READ_EXCEPTION_STATUS, _FC_REPORT_SLAVE_ID */
-            length = 0;
-        }
 #if MODBUS_PROCESS_CONFIRMATION
-    } else {
-        /* MSG_CONFIRMATION */
-        switch (function) {
-        case _FC_WRITE_SINGLE_COIL:
-        case _FC_WRITE_SINGLE_REGISTER:
-        case _FC_WRITE_MULTIPLE_COILS:
-        case _FC_WRITE_MULTIPLE_REGISTERS:
-            length = 4;
-            break;
-        case _FC_MASK_WRITE_REGISTER:
-            length = 6;
-            break;
-        default:
-            length = 1;
-        }
+    if (msg_type == MSG_CONFIRMATION)
+	return FC_CONF_META(_modbus_fc_desc[function]);
 #endif
-    }
-
-    return length;
+    return FC_IND_META(_modbus_fc_desc[function]);
 }
 
 static uint8_t compute_data_length_after_meta(
                 uint8_t *modbus_msg, msg_type_t msg_type) {
-    uint8_t function = modbus_msg[1];
-    uint8_t length;
-
-    if (msg_type == MSG_INDICATION) {
-        switch (function) {
-        case _FC_WRITE_MULTIPLE_COILS:
-        case _FC_WRITE_MULTIPLE_REGISTERS:
-            length = modbus_msg[6];
-            break;
-        case _FC_WRITE_AND_READ_REGISTERS:
-            length = modbus_msg[10];
-            break;
-        default:
-            length = 0;
-        }
+    uint8_t offset;
+
 #if MODBUS_PROCESS_CONFIRMATION
-    } else {
-        /* MSG_CONFIRMATION */
-        if (function <= _FC_READ_INPUT_REGISTERS ||
-            function == _FC_REPORT_SLAVE_ID ||
-            function == _FC_WRITE_AND_READ_REGISTERS) {
-            length = modbus_msg[2];
-        } else {
-            length = 0;
-        }
+    if (msg_type == MSG_CONFIRMATION)
+	offset = FC_CONF_COUNT(_modbus_fc_desc[modbus_msg[1]]);
+    else
+#endif
+	offset = FC_IND_COUNT(_modbus_fc_desc[modbus_msg[1]]);
+
+    if (!offset) return CRC_LENGTH;
+    return modbus_msg[offset] + CRC_LENGTH;
+}
+
+/* Register maps from modbus-local.h. A request is accepted if it falls
+ * entirely within one of the listed ranges. Tables without a map are left for
+ * the handler to check. The offset from start wraps for addresses below it,
+ * so one unsigned compare covers both ends of the range. */
+#define _MAP_OFFSET(start) ((uint16_t) (addr - (start)))
+#define _MAP_RANGE(start, count)					    \
+	|| (_MAP_OFFSET(start) < (count) &&				    \
+	    _MAP_OFFSET(start) + nr <= (count))
+
+/* Function codes that read or write each table */
+#define HAS_COILS	(HAS_READ_COILS || HAS_WRITE_SINGLE_COIL ||	    \
+			 HAS_WRITE_MULTIPLE_COILS)
+#define HAS_HOLDING_REGS (HAS_READ_HOLDING_REGISTERS ||			    \
+			 HAS_WRITE_SINGLE_REGISTER ||			    \
+			 HAS_WRITE_MULTIPLE_REGISTERS ||		    \
+			 HAS_MASK_WRITE_REGISTER ||			    \
+			 HAS_WRITE_AND_READ_REGISTERS)
+
+#if defined(MODBUS_COIL_MAP) && HAS_COILS
+static uint8_t coils_valid(uint16_t addr, uint16_t nr) {
+    return 0 MODBUS_COIL_MAP(_MAP_RANGE);
+}
+#else
+#define coils_valid(addr, nr) ((void) (addr), 1)
+#endif
+
+#if defined(MODBUS_DISCRETE_INPUT_MAP) && HAS_READ_DISCRETE_INPUTS
+static uint8_t discrete_inputs_valid(uint16_t addr, uint16_t nr) {
+    return 0 MODBUS_DISCRETE_INPUT_MAP(_MAP_RANGE);
+}
+#else
+#define discrete_inputs_valid(addr, nr) ((void) (addr), 1)
 #endif
+
+#if defined(MODBUS_HOLDING_REG_MAP) && HAS_HOLDING_REGS
+static uint8_t holding_regs_valid(uint16_t addr, uint16_t nr) {
+    return 0 MODBUS_HOLDING_REG_MAP(_MAP_RANGE);
+}
+#else
+#define holding_regs_valid(addr, nr) ((void) (addr), 1)
+#endif
+
+#if defined(MODBUS_INPUT_REG_MAP) && HAS_READ_INPUT_REGISTERS
+static uint8_t input_regs_valid(uint16_t addr, uint16_t nr) {
+    return 0 MODBUS_INPUT_REG_MAP(_MAP_RANGE);
+}
+#else
+#define input_regs_valid(addr, nr) ((void) (addr), 1)
+#endif
+
+/* Checks a request against the frame limits and register maps before the
+ * handler is invoked. Returns 0 or the exception code to reply with. Only
+ * function codes with a handler are checked, as no others get this far. */
+static uint8_t modbus_validate(uint8_t function, uint8_t *msg) {
+    uint16_t addr = mb_buf_to_val(&msg[MODBUS_MSG_ADDR_OFFSET]);
+    uint16_t nr = mb_buf_to_val(&msg[MODBUS_MSG_NR_REGS_OFFSET]);
+    uint8_t valid = 1;
+
+    (void) addr;
+    (void) nr;
+
+#ifdef MODBUS_BUSY_FUNC
+    if (MODBUS_BUSY_FUNC()) return MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
+#endif
+
+    switch (function) {
+#if HAS_READ_COILS
+	case _FC_READ_COILS:
+	    if (!nr || nr > MAX_NR_COILS(function))
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = coils_valid(addr, nr);
+	    break;
+#endif
+
+#if HAS_READ_DISCRETE_INPUTS
+	case _FC_READ_DISCRETE_INPUTS:
+	    if (!nr || nr > MAX_NR_COILS(function))
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = discrete_inputs_valid(addr, nr);
+	    break;
+#endif
+
+#if HAS_READ_HOLDING_REGISTERS
+	case _FC_READ_HOLDING_REGISTERS:
+	    if (!nr || nr > MAX_NR_REGS(function))
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = holding_regs_valid(addr, nr);
+	    break;
+#endif
+
+#if HAS_READ_INPUT_REGISTERS
+	case _FC_READ_INPUT_REGISTERS:
+	    if (!nr || nr > MAX_NR_REGS(function))
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = input_regs_valid(addr, nr);
+	    break;
+#endif
+
+#if HAS_WRITE_SINGLE_COIL
+	case _FC_WRITE_SINGLE_COIL:
+	    /* The value field must be either 0xFF00 or 0x0000 */
+	    if (nr != 0xFF00 && nr != 0x0000)
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = coils_valid(addr, 1);
+	    break;
+#endif
+
+#if HAS_WRITE_SINGLE_REGISTER
+	case _FC_WRITE_SINGLE_REGISTER:
+#endif
+#if HAS_MASK_WRITE_REGISTER
+	case _FC_MASK_WRITE_REGISTER:
+#endif
+#if HAS_WRITE_SINGLE_REGISTER || HAS_MASK_WRITE_REGISTER
+	    valid = holding_regs_valid(addr, 1);
+	    break;
+#endif
+
+#if HAS_WRITE_MULTIPLE_COILS
+	case _FC_WRITE_MULTIPLE_COILS:
+	    if (!nr || nr > MAX_NR_COILS(function) ||
+		    msg[4] != (nr + 7) / 8)
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = coils_valid(addr, nr);
+	    break;
+#endif
+
+#if HAS_WRITE_MULTIPLE_REGISTERS
+	case _FC_WRITE_MULTIPLE_REGISTERS:
+	    if (!nr || nr > MAX_NR_WRITE_REGS(function) || msg[4] != nr * 2)
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = holding_regs_valid(addr, nr);
+	    break;
+#endif
+
+#if HAS_READ_FILE_RECORD
+	case _FC_READ_FILE_RECORD:
+	    /* Sub-requests are 7 bytes each */
+	    if (msg[0] < 7 || msg[0] > 0xF5 || msg[0] % 7)
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    break;
+#endif
+
+#if HAS_WRITE_FILE_RECORD
+	case _FC_WRITE_FILE_RECORD:
+	    if (msg[0] < 9 || msg[0] > 0xFB)
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    break;
+#endif
+
+#if HAS_WRITE_AND_READ_REGISTERS
+	case _FC_WRITE_AND_READ_REGISTERS:
+	    if (!nr || nr > MAX_NR_REGS(function))
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = holding_regs_valid(addr, nr);
+	    /* The write block follows the read block */
+	    addr = mb_buf_to_val(&msg[4]);
+	    nr = mb_buf_to_val(&msg[6]);
+	    if (!nr || nr > MAX_NR_WRITE_REGS(function) || msg[8] != nr * 2)
+		return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	    valid = valid && holding_regs_valid(addr, nr);
+	    break;
+#endif
+
+	default:
+	    break;
     }
 
-    length += CRC_LENGTH;
+    return valid ? 0 : MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+}
 
-    return length;
+/* Runs the handler for the request in frame, which is overwritten with the
+ * response. Returns the number of response bytes, or a negated exception
+ * code. */
+static int8_t modbus_process(uint8_t *frame) {
+    uint8_t function = frame[MODBUS_FUNCTION_OFFSET];
+    uint8_t *msg = frame + HEADER_FUNCTION_LENGTH;
+    modbus_process_t handler;
+    int8_t bytes;
+
+    /* Unsupported function codes and malformed requests are rejected without
+     * calling into the application */
+    handler = function > _FC_MAX ? NULL : _modbus_handlers[function];
+    if (!handler) return -MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    if ((bytes = modbus_validate(function, msg))) return -bytes;
+
+    mb_unit_id = frame[MODBUS_SLAVE_OFFSET];
+    return handler(function, msg);
 }
 
-static void modbus_reply(int8_t bytes) { 
+#if MODBUS_FORWARD_PACKETS
+/* Outbound interfaces, each with one transaction in progress at a time and
+ * its own queue of frames waiting for that to finish */
+#define _PORT_WRITE(write, ready)	write,
+#define _PORT_READY(write, ready)	ready,
+static const modbus_forward_t CYCODE _modbus_port_write[] = {
+    MODBUS_FORWARD_PORTS(_PORT_WRITE)
+};
+static const modbus_write_ready_t CYCODE _modbus_port_ready[] = {
+    MODBUS_FORWARD_PORTS(_PORT_READY)
+};
+
+typedef enum {
+    _PORT_IDLE,
+    _PORT_RESPONSE,	/* Waiting for the response, or the response timeout */
+    _PORT_TURNAROUND,	/* Waiting out the turnaround delay after a broadcast */
+    _PORT_SILENCE,	/* Waiting for a response of unknown length to end */
+} _port_state_t;
+
+/* Enough of a response to find its byte count */
+#define PORT_RX_HEADER	4
+
+static struct {
+    uint8_t msg[MODBUS_FORWARD_QUEUE][MODBUS_MAX_PACKET_LENGTH];
+    uint8_t length[MODBUS_FORWARD_QUEUE];
+    uint8_t head;
+    uint8_t count;
+    _port_state_t state;
+    uint8_t rx[PORT_RX_HEADER];
+    uint8_t rx_length;
+    uint8_t rx_expected;    /* 0 until the response length is known */
+} _modbus_ports[NR_PORTS];
+
+/* Outbound interface for each unit ID. All unit IDs start out routed to the
+ * first interface. */
+static uint8_t _modbus_route[256];
+
+static uint8_t modbus_port_ready(uint8_t port) {
+    if (_modbus_ports[port].state != _PORT_IDLE) return 0;
+    return !_modbus_port_ready[port] || _modbus_port_ready[port]();
+}
+
+/* Starts a transaction. Broadcasts are never answered, so only the
+ * turnaround delay is waited out before the next request. */
+static void modbus_port_send(uint8_t port, const uint8_t *msg, uint8_t bytes) {
+    _modbus_port_write[port](msg, bytes);
+    _modbus_ports[port].rx_length = 0;
+    _modbus_ports[port].rx_expected = 0;
+    if (msg[MODBUS_SLAVE_OFFSET] != MODBUS_BROADCAST_ADDRESS) {
+	_modbus_ports[port].state = _PORT_RESPONSE;
+	_modbus_port_timer_start(port, MODBUS_RESPONSE_TIMEOUT_MS);
+    } else if (MODBUS_TURNAROUND_MS) {
+	_modbus_ports[port].state = _PORT_TURNAROUND;
+	_modbus_port_timer_start(port, MODBUS_TURNAROUND_MS);
+    }
+}
+
+/* Returns 0 if the interface queue is full */
+static uint8_t modbus_forward(uint8_t port, uint8_t bytes) {
+    uint8_t tail;
+
+    /* Nothing is queued ahead of this frame, so it can go out directly */
+    if (!_modbus_ports[port].count && modbus_port_ready(port)) {
+	modbus_port_send(port, modbus_msg, bytes);
+	return 1;
+    }
+
+    if (_modbus_ports[port].count == MODBUS_FORWARD_QUEUE) return 0;
+    tail = (_modbus_ports[port].head + _modbus_ports[port].count++) %
+	    MODBUS_FORWARD_QUEUE;
+    memcpy(_modbus_ports[port].msg[tail], modbus_msg, bytes);
+    _modbus_ports[port].length[tail] = bytes;
+    return 1;
+}
+
+static void modbus_port_idle(uint8_t port) {
+    _modbus_port_timer_stop(port);
+    _modbus_ports[port].state = _PORT_IDLE;
+}
+
+static void modbus_forward_service(void) {
+    uint8_t port, head;
+
+    for (port = 0; port < NR_PORTS; port++) {
+	if (_modbus_ports[port].state != _PORT_IDLE &&
+			_modbus_port_timer_finished(port))
+	    modbus_port_idle(port);
+
+	if (!_modbus_ports[port].count || !modbus_port_ready(port)) continue;
+	head = _modbus_ports[port].head;
+	modbus_port_send(port, _modbus_ports[port].msg[head],
+			_modbus_ports[port].length[head]);
+	_modbus_ports[port].head = (head + 1) % MODBUS_FORWARD_QUEUE;
+	_modbus_ports[port].count--;
+    }
+}
+
+/* Follows the response framing, and ends the transaction once the whole
+ * response has arrived. The CRC is left for the master to check. Responses
+ * to function codes that the framing table does not describe end after
+ * MODBUS_PORT_SILENCE_MS without a byte. */
+void modbus_port_rx(uint8_t port, const uint8_t *data, uint8_t bytes) {
+    uint8_t function, offset;
+
+    if (_modbus_ports[port].state == _PORT_SILENCE) {
+	if (bytes) _modbus_port_timer_start(port, MODBUS_PORT_SILENCE_MS);
+	return;
+    }
+
+    while (bytes-- && _modbus_ports[port].state == _PORT_RESPONSE) {
+	if (_modbus_ports[port].rx_length < PORT_RX_HEADER)
+	    _modbus_ports[port].rx[_modbus_ports[port].rx_length] = *data;
+	data++;
+	_modbus_ports[port].rx_length++;
+
+	if (!_modbus_ports[port].rx_expected &&
+			_modbus_ports[port].rx_length >= HEADER_FUNCTION_LENGTH) {
+	    function = _modbus_ports[port].rx[1];
+	    if (!(function & MODBUS_EXCEPTION) &&
+			    FC_UNKNOWN(_modbus_fc_desc[function])) {
+		_modbus_ports[port].state = _PORT_SILENCE;
+		_modbus_port_timer_start(port, MODBUS_PORT_SILENCE_MS);
+		return;
+	    }
+	    offset = FC_CONF_COUNT(_modbus_fc_desc[function]);
+	    if (!offset || _modbus_ports[port].rx_length == offset + 1) {
+		_modbus_ports[port].rx_expected = HEADER_FUNCTION_LENGTH +
+		    FC_CONF_META(_modbus_fc_desc[function]) +
+		    (offset ? _modbus_ports[port].rx[offset] : 0) + CRC_LENGTH;
+	    }
+	}
+
+	if (_modbus_ports[port].rx_length == _modbus_ports[port].rx_expected)
+	    modbus_port_idle(port);
+    }
+}
+
+void modbus_route(uint8_t slave_addr, uint8_t port) {
+    _modbus_route[slave_addr] = port;
+}
+#endif
+
+/* Called once the previous reply has left the transmitter. With
+ * MODBUS_TX_COMPLETE_CALLBACK the port calls this itself, which may be from
+ * its transmit complete or DMA interrupt. */
+void modbus_tx_complete(void) {
+    _modbus_tx_busy = 0;
+    if (_tx_led_enable) _tx_led_enable(!_tx_led_enable_val);
+}
+
+static uint8_t modbus_tx_ready(void) {
+#if MODBUS_TX_COMPLETE_CALLBACK
+    return !_modbus_tx_busy;
+#else
+#if MODBUS_USE_FUNCTION_POINTERS
+    if (_modbus_write_ready && !_modbus_write_ready()) return 0;
+#elif defined(_modbus_write_ready)
+    if (!_modbus_write_ready()) return 0;
+#endif
+    if (_modbus_tx_busy) modbus_tx_complete();
+    return 1;
+#endif
+}
+
+/* Must only be called when modbus_tx_ready(). If exception is non-zero the
+ * request is answered with it, without being processed. */
+static void modbus_reply(const uint8_t *req, uint8_t bytes,
+		uint8_t exception) { 
     uint8_t function;
+    int8_t retval;
     uint16_t crc;
 
     if (_tx_led_enable) _tx_led_enable(_tx_led_enable_val);
-    function = modbus_msg[MODBUS_FUNCTION_OFFSET];
+    memcpy(modbus_tx_msg, req, bytes);
+    function = modbus_tx_msg[MODBUS_FUNCTION_OFFSET];
 
-    bytes -= HEADER_FUNCTION_LENGTH;
-    if ((bytes = _modbus_process(function,
-			    modbus_msg + HEADER_FUNCTION_LENGTH)) < 0) {
+    if (exception) retval = -exception;
+    else retval = modbus_process(modbus_tx_msg);
+    if (retval < 0) {
 	function |= MODBUS_EXCEPTION;
-	modbus_msg[HEADER_FUNCTION_LENGTH] = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
-	bytes = 1;
+	modbus_tx_msg[HEADER_FUNCTION_LENGTH] = -retval;
+	retval = 1;
     }
-    bytes += HEADER_FUNCTION_LENGTH;
+    bytes = retval + HEADER_FUNCTION_LENGTH;
 
-    modbus_msg[MODBUS_FUNCTION_OFFSET] = function;
-    crc = crc16_bytes(modbus_msg, bytes);
-    modbus_msg[bytes++] = CRC_0(crc);
-    modbus_msg[bytes++] = CRC_1(crc);
-    _modbus_write(modbus_msg, bytes);
-    if (_tx_led_enable) _tx_led_enable(!_tx_led_enable_val);
+    modbus_tx_msg[MODBUS_FUNCTION_OFFSET] = function;
+    crc = crc16_bytes(modbus_tx_msg, bytes);
+    modbus_tx_msg[bytes++] = CRC_0(crc);
+    modbus_tx_msg[bytes++] = CRC_1(crc);
+
+    /* Without a ready function or completion callback the write is taken to
+     * be synchronous */
+    _modbus_tx_busy = 1;
+    _modbus_write(modbus_tx_msg, bytes);
+#if MODBUS_TX_COMPLETE_CALLBACK
+#elif MODBUS_USE_FUNCTION_POINTERS
+    if (!_modbus_write_ready) modbus_tx_complete();
+#elif !defined(_modbus_write_ready)
+    modbus_tx_complete();
+#endif
 }
 
 uint8_t modbus_poll(void) {
@@ -194,11 +738,36 @@ uint8_t modbus_poll(void) {
     static uint8_t msg_length = 0;
     static _step_t step = _STEP_FUNCTION;
     static msg_type_t msg_type = MSG_INDICATION;
+    uint8_t exception;
     uint8_t retval = 0;
     uint16_t crc;
     uint8_t slave;
+#if MODBUS_FORWARD_PACKETS
+    uint8_t port;
+
+    modbus_forward_service();
+#endif
+
+#if MODBUS_TX_ASYNC
+    /* A held request is dropped if the transmitter is not free within the
+     * hold timeout, as the master will have given up on it */
+    if (_modbus_held_bytes) {
+	if (modbus_tx_ready()) {
+	    retval = _modbus_held_bytes;
+	    modbus_reply(modbus_held_msg, retval, _modbus_held_exception);
+	    _modbus_held_bytes = 0;
+	    _modbus_hold_timer_stop_and_reset();
+	} else if (_modbus_hold_timer_finished) {
+	    _modbus_held_bytes = 0;
+	    _modbus_hold_timer_stop_and_reset();
+	}
+    }
+#endif
 
     if (msg_length && _modbus_timer_finished) goto reset;
+
+    /* Poll for completion of the previous reply */
+    if (_modbus_tx_busy) modbus_tx_ready();
     
     if (!_modbus_read_ready()) return 0;
     
@@ -243,24 +812,65 @@ uint8_t modbus_poll(void) {
 	if (msg_type == MSG_CONFIRMATION) goto reset;
 
 	slave = modbus_msg[MODBUS_SLAVE_OFFSET];
-	if (slave != _slave_addr) {
+	if (slave == MODBUS_BROADCAST_ADDRESS) {
 #if MODBUS_FORWARD_PACKETS
-	    /* Forward this packet on to the next interface */
-	    _modbus_forward(modbus_msg, msg_length);
-	    goto reset;
+	    /* Forward first, as the handler may overwrite the request */
+	    for (port = 0; port < NR_PORTS; port++)
+		modbus_forward(port, msg_length);
 #endif
+	    /* Writes are applied locally, but never answered */
+	    if (_modbus_fc_desc[modbus_msg[MODBUS_FUNCTION_OFFSET]].count &
+			    FC_BROADCAST)
+		modbus_process(modbus_msg);
+	    goto reset;
+	}
+
+	exception = 0;
+	if (!SLAVE_ADDR_OWNED(slave)) {
+#if MODBUS_FORWARD_PACKETS
+	    /* Forward this packet on to the interface for its unit ID. The
+	     * gateway answers for it if that cannot be done. */
+	    port = _modbus_route[slave];
+	    if (port >= NR_PORTS)
+		exception = MODBUS_EXCEPTION_GATEWAY_PATH;
+	    else if (!modbus_forward(port, msg_length))
+		exception = MODBUS_EXCEPTION_SLAVE_OR_SERVER_BUSY;
+	    else
+		goto reset;
+#else
 	    /* Leave the timer running so that a reset will occur if no
 	     * device ever responds */
 	    msg_type = MSG_CONFIRMATION;
 	    goto reset_with_timeout;
+#endif
+	}
+
+#if MODBUS_TX_ASYNC
+	/* A newer request replaces a held one, as the master has stopped
+	 * waiting for that */
+	_modbus_held_bytes = 0;
+	_modbus_hold_timer_stop_and_reset();
+
+	/* The transmit buffer is still in use by the previous reply. Hold the
+	 * request until it can be answered, and carry on receiving so that
+	 * requests for other unit IDs are still forwarded. */
+	if (!modbus_tx_ready()) {
+	    memcpy(modbus_held_msg, modbus_msg, retval);
+	    _modbus_held_bytes = retval;
+	    _modbus_held_exception = exception;
+	    _modbus_hold_timer_start();
+	    goto reset;
 	}
+#endif
 
-	modbus_reply(retval);
+	modbus_reply(modbus_msg, retval, exception);
 
 reset:
 	_modbus_timer_stop_and_reset();
 	msg_type = MSG_INDICATION;
+#if !MODBUS_FORWARD_PACKETS
 reset_with_timeout:
+#endif
 	msg_length = 0;
 	length_to_read = HEADER_FUNCTION_LENGTH;
 	step = _STEP_FUNCTION;
@@ -270,22 +880,52 @@ reset_with_timeout:
     return retval;
 }
 
+#if MODBUS_FILES
+/* A file that has not been written is empty */
+static void mb_files_init(void) {
+    uint8_t file;
+
+    for (file = 0; file < MODBUS_FILES; file++) mb_files[file].crc = CRC32_INIT;
+}
+#endif
+
 #if MODBUS_USE_FUNCTION_POINTERS
 void modbus_init(
 	    uint8_t		slave_addr,
             modbus_write_t      modbus_write,
+            modbus_write_ready_t modbus_write_ready,
             modbus_read_ready_t modbus_read_ready,
-            modbus_read_t       modbus_read,
-            modbus_process_t    modbus_process) {
+            modbus_read_t       modbus_read) {
     _modbus_write	= modbus_write;
+    _modbus_write_ready	= modbus_write_ready;
     _modbus_read_ready	= modbus_read_ready;
     _modbus_read	= modbus_read;
-    _modbus_process	= modbus_process;
 #else
 void modbus_init(uint8_t slave_addr) {
 #endif
-    _slave_addr = slave_addr;
+#if MODBUS_FILES
+    mb_files_init();
+#endif
+    modbus_add_slave_addr(slave_addr);
     _modbus_timer_init();
+#if MODBUS_TX_ASYNC
+    _modbus_hold_timer_init();
+#endif
+#if MODBUS_FORWARD_PACKETS
+    _modbus_port_timer_init();
+#endif
+#if MODBUS_RS485_DE_CONTROL
+    _modbus_rs485_init();
+#endif
+}
+
+void modbus_add_slave_addr(uint8_t slave_addr) {
+    if (slave_addr == MODBUS_BROADCAST_ADDRESS) return;
+    _slave_addrs[slave_addr >> 3] |= 1 << (slave_addr & 7);
+}
+
+void modbus_remove_slave_addr(uint8_t slave_addr) {
+    _slave_addrs[slave_addr >> 3] &= ~(1 << (slave_addr & 7));
 }
 
 void modbus_tx_led(void (*led_enable)(uint8_t val), uint8_t val) {
@@ -299,15 +939,18 @@ void modbus_rx_led(void (*led_enable)(uint8_t val), uint8_t val) {
 }
 
 /* Helper functions */
-int8_t modbus_slave_id_response(uint8_t *msg) {
+int8_t modbus_slave_id_response(uint8_t function, uint8_t *msg) {
+    (void) function;
+
     msg[0] = sizeof(MODBUS_SLAVE_STRING) + 2;
-    msg[1] = _slave_addr;
+    msg[1] = mb_unit_id;
     msg[2] = 0xff; /* Run indicator status */
     memcpy(&msg[3], MODBUS_SLAVE_STRING, sizeof(MODBUS_SLAVE_STRING));
     return sizeof(MODBUS_SLAVE_STRING) + 3;
 }
 
 /* Iterators */
+uint8_t mb_unit_id;
 uint16_t mb_address;
 uint8_t	mb_nr_regs;
 uint8_t mb_resp_bytes;
@@ -345,3 +988,184 @@ uint16_t mb_data_next(uint8_t *msg) {
     _mb_data_offset += 2;
     return retval;
 }
+
+/* Register images */
+void mb_image_resp(uint8_t *msg, struct mb_image_s *image, uint8_t reg) {
+    uint8_t nr = image->nr_regs - reg;
+    uint8_t seq, offset, i;
+
+    if (nr > mb_nr_regs) nr = mb_nr_regs;
+
+    /* Copy straight into the response, and start again if a writer
+     * published in the meantime */
+    do {
+	seq = image->seq;
+	offset = _mb_data_offset;
+	for (i = 0; i < nr; i++)
+	    offset += mb_val_to_buf(&msg[offset], image->regs[reg + i]);
+    } while ((seq & 1) || seq != image->seq);
+
+    _mb_data_offset = offset;
+    mb_nr_regs -= nr;
+    mb_address += nr;
+}
+
+/* FIFO queues */
+uint8_t mb_fifo_push(struct mb_fifo_s *fifo, uint16_t val) {
+    uint8_t head = fifo->head;
+    uint8_t next = (head + 1) & (MODBUS_FIFO_SIZE - 1);
+
+    if (next == fifo->tail) return 0;
+    fifo->_data[head] = val;
+    /* Publish only once the value is in place */
+    fifo->head = next;
+    return 1;
+}
+
+int8_t mb_fifo_resp(uint8_t *msg, struct mb_fifo_s *fifo) {
+    uint8_t seq = msg[MODBUS_MSG_ADDR_OFFSET] & MB_FIFO_SEQ >> 8;
+    uint8_t tail = fifo->tail;
+    uint8_t sent = fifo->_sent;
+    uint8_t head, count = 0;
+    uint8_t offset = 4;
+
+    /* The master has the batch sent last, so its slots go back to the
+     * producer */
+    if (seq != fifo->_seq) {
+	fifo->tail = tail = sent;
+	fifo->_seq = seq;
+    }
+
+    /* A new batch is only taken once the last one has been acknowledged,
+     * otherwise it is sent again */
+    if (sent == tail) {
+	head = fifo->head;
+	while (sent != head && count++ < MAX_NR_REGS(_FC_READ_FIFO_QUEUE))
+	    sent = (sent + 1) & (MODBUS_FIFO_SIZE - 1);
+	fifo->_sent = sent;
+    }
+
+    for (count = 0; tail != sent; count++) {
+	offset += mb_val_to_buf(&msg[offset], fifo->_data[tail]);
+	tail = (tail + 1) & (MODBUS_FIFO_SIZE - 1);
+    }
+
+    mb_val_to_buf(&msg[0], offset - 2);
+    mb_val_to_buf(&msg[2], count);
+    return offset;
+}
+
+/* File records */
+#define FILE_REF_TYPE		6
+#define FILE_MAX_RECORD		0x270F
+#define FILE_SUB_REQ_LENGTH	7
+
+#if MODBUS_FILES
+struct mb_file_s mb_files[MODBUS_FILES];
+#endif
+
+#ifdef MODBUS_FILE_SOURCE_FUNC
+int8_t modbus_read_file_record(uint8_t function, uint8_t *msg) {
+    uint8_t req[MODBUS_MAX_PACKET_LENGTH];
+    uint8_t req_bytes = msg[0];
+    uint8_t offset = 1;
+    uint8_t *sub;
+    uint16_t file, record, nr;
+    int8_t retval;
+
+    (void) function;
+
+    /* The response overtakes the request as it is built, so work from a
+     * copy of the sub-requests */
+    memcpy(req, &msg[1], req_bytes);
+
+    for (sub = req; sub < req + req_bytes; sub += FILE_SUB_REQ_LENGTH) {
+	file = mb_buf_to_val(&sub[1]);
+	record = mb_buf_to_val(&sub[3]);
+	nr = mb_buf_to_val(&sub[5]);
+	if (sub[0] != FILE_REF_TYPE || !nr)
+	    return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	/* Sub-response header, data and the CRC must fit the frame */
+	if (nr > MODBUS_MAX_PACKET_LENGTH / 2 || offset + 2 + nr * 2 >
+		MODBUS_MAX_PACKET_LENGTH - HEADER_FUNCTION_LENGTH - CRC_LENGTH)
+	    return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	if (!file || record > FILE_MAX_RECORD)
+	    return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+	msg[offset++] = 1 + nr * 2;
+	msg[offset++] = FILE_REF_TYPE;
+	if ((retval = MODBUS_FILE_SOURCE_FUNC(file, record, &msg[offset], nr)))
+	    return retval;
+	offset += nr * 2;
+    }
+
+    msg[0] = offset - 1;
+    return offset;
+}
+#endif
+
+#ifdef MODBUS_FILE_SINK_FUNC
+int8_t modbus_write_file_record(uint8_t function, uint8_t *msg) {
+    uint8_t *end = &msg[1] + msg[0];
+    uint8_t *sub;
+    uint16_t file, record, nr;
+    int8_t retval;
+#if MODBUS_FILES
+    struct mb_file_s *state;
+#endif
+
+    (void) function;
+
+    for (sub = &msg[1]; sub < end; sub += FILE_SUB_REQ_LENGTH + nr * 2) {
+	if (end - sub < FILE_SUB_REQ_LENGTH)
+	    return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	file = mb_buf_to_val(&sub[1]);
+	record = mb_buf_to_val(&sub[3]);
+	nr = mb_buf_to_val(&sub[5]);
+	if (sub[0] != FILE_REF_TYPE || !nr ||
+		nr > (end - sub - FILE_SUB_REQ_LENGTH) / 2)
+	    return -MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+	if (!file || record > FILE_MAX_RECORD)
+	    return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+
+#if MODBUS_FILES
+	/* Tracked files are written in order, so that the CRC covers the
+	 * whole file. Record 0 restarts the file. */
+	state = file <= MODBUS_FILES ? &mb_files[file - 1] : NULL;
+	if (state) {
+	    /* The master missed the response to this */
+	    if (record == state->last_record && nr == state->last_nr)
+		continue;
+	    if (!record) {
+		state->crc = CRC32_INIT;
+		state->next_record = 0;
+		state->stale = 0;
+	    } else if (record > state->next_record) {
+		return -MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+	    } else if (record < state->next_record) {
+		state->stale = 1;
+	    }
+	}
+#endif
+
+	if ((retval = MODBUS_FILE_SINK_FUNC(file, record,
+				&sub[FILE_SUB_REQ_LENGTH], nr)))
+	    return retval;
+
+#if MODBUS_FILES
+	if (state) {
+	    if (!state->stale)
+		state->crc = crc32_bytes(state->crc,
+				&sub[FILE_SUB_REQ_LENGTH], nr * 2);
+	    if (record + nr > state->next_record)
+		state->next_record = record + nr;
+	    state->last_record = record;
+	    state->last_nr = nr;
+	}
+#endif
+    }
+
+    /* The response echoes the request */
+    return 1 + msg[0];
+}
+#endif
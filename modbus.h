@@ -28,8 +28,11 @@
 #define _FC_WRITE_MULTIPLE_COILS      0x0F
 #define _FC_WRITE_MULTIPLE_REGISTERS  0x10
 #define _FC_REPORT_SLAVE_ID           0x11
+#define _FC_READ_FILE_RECORD          0x14
+#define _FC_WRITE_FILE_RECORD         0x15
 #define _FC_MASK_WRITE_REGISTER       0x16
 #define _FC_WRITE_AND_READ_REGISTERS  0x17
+#define _FC_READ_FIFO_QUEUE           0x18
 
 #define MODBUS_EXCEPTION 0x80
 enum {
@@ -55,19 +58,124 @@ enum {
 #define MODBUS_WRITE_RESP_SIZE	    4
 
 /* Helper functions */
+extern uint8_t mb_unit_id;
 extern uint16_t mb_address;
 extern uint8_t mb_nr_regs;
 extern uint8_t mb_resp_bytes;
-extern int8_t modbus_slave_id_response(uint8_t *msg);
+extern int8_t modbus_slave_id_response(uint8_t function, uint8_t *msg);
 extern void mb_data_init(uint8_t *msg, uint8_t fn);
 extern void mb_data_resp(uint8_t *msg, uint16_t val);
 extern uint16_t mb_data_next(uint8_t *msg);
 
-/* Limits for user function */
-#define MAX_NR_REGS(fn) (   fn == _FC_READ_HOLDING_REGISTERS ?		    \
+/* Register image for values updated asynchronously to modbus_poll(), such as
+ * 32 bit and multi-word values written by an ISR. Writers bracket an update
+ * with mb_image_write_begin() and mb_image_write_end(), and must not be
+ * preempted by modbus_poll(). regs points at volatile storage, so that the
+ * register writes stay between the two. mb_image_resp() responds with the
+ * registers from reg to the end of the image, or up to mb_nr_regs, and
+ * retries if a writer ran during the copy. Reads never mask interrupts. */
+struct mb_image_s {
+    volatile uint16_t *regs;
+    uint8_t nr_regs;
+    volatile uint8_t seq;
+};
+
+#define mb_image_write_begin(image) ((image)->seq++)
+#define mb_image_write_end(image) ((image)->seq++)
+extern void mb_image_resp(uint8_t *msg, struct mb_image_s *image, uint8_t reg);
+
+/* File record handlers. Bind them with MODBUS_READ_FILE_RECORD_FUNC and
+ * MODBUS_WRITE_FILE_RECORD_FUNC, and supply the data through
+ * MODBUS_FILE_SOURCE_FUNC and MODBUS_FILE_SINK_FUNC:
+ *   int8_t source(uint16_t file, uint16_t record, uint8_t *data, uint8_t nr);
+ *   int8_t sink(uint16_t file, uint16_t record, const uint8_t *data,
+ *		uint8_t nr);
+ * Each sub-request is passed as a single block of nr registers in wire
+ * order, starting at record. They return 0 or a negated MODBUS_EXCEPTION_
+ * code.
+ *
+ * Files 1 to MODBUS_FILES are tracked while they are written. next_record is
+ * the record to resume from, and MB_FILE_CRC() is the CRC32 of the records
+ * before it, for checking the whole file once written. A repeat of the last
+ * sub-request, from a master that missed the response, is acknowledged
+ * without being written again. Any other write before next_record reaches the
+ * sink, but sets MB_FILE_STALE(), as the CRC no longer describes the file
+ * until it is written again from record 0. */
+extern int8_t modbus_read_file_record(uint8_t function, uint8_t *msg);
+extern int8_t modbus_write_file_record(uint8_t function, uint8_t *msg);
+
+#ifndef MODBUS_FILES
+#define MODBUS_FILES 0
+#endif
+#if MODBUS_FILES
+struct mb_file_s {
+    uint32_t crc;
+    uint16_t next_record;
+    uint16_t last_record;   /* The last sub-request written */
+    uint8_t last_nr;
+    uint8_t stale;
+};
+
+extern struct mb_file_s mb_files[MODBUS_FILES];
+#define MB_FILE_CRC(file) (~mb_files[(file) - 1].crc)
+#define MB_FILE_STALE(file) (mb_files[(file) - 1].stale)
+#endif
+
+/* Lock free FIFO for Read FIFO Queue. A single producer, which may be an ISR,
+ * calls mb_fifo_push(), which returns 0 if the FIFO is full. The handler
+ * answers with mb_fifo_resp(), which sends as many values as fit in one
+ * response. Unlike a plain Modbus FIFO, values are removed once the master
+ * acknowledges them. It does so with MB_FIFO_SEQ, the top bit of the FIFO
+ * pointer address, which it toggles after each response it receives. A
+ * request with the same bit again is a retry, and is sent the same values.
+ * A toggled bit releases those values and takes the next batch.
+ * MB_FIFO_ADDR() is the pointer address without the bit.
+ * MODBUS_FIFO_SIZE must be a power of two, and holds one value less than its
+ * size. */
+#ifndef MODBUS_FIFO_SIZE
+#define MODBUS_FIFO_SIZE 32
+#endif
+struct mb_fifo_s {
+    volatile uint16_t _data[MODBUS_FIFO_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    uint8_t _sent;	/* Tail once the batch sent last is acknowledged */
+    uint8_t _seq;	/* MB_FIFO_SEQ of the request for that batch */
+};
+
+#define MB_FIFO_SEQ 0x8000
+#define MB_FIFO_ADDR(msg)						    \
+	(mb_buf_to_val(&(msg)[MODBUS_MSG_ADDR_OFFSET]) & ~MB_FIFO_SEQ)
+
+extern uint8_t mb_fifo_push(struct mb_fifo_s *fifo, uint16_t val);
+extern int8_t mb_fifo_resp(uint8_t *msg, struct mb_fifo_s *fifo);
+
+#define MB_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Limits for user function. Requests beyond these are rejected with
+ * MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE before the user function is called. */
+#define MAX_NR_REGS(fn) (   fn == _FC_READ_HOLDING_REGISTERS ||		    \
+			    fn == _FC_READ_INPUT_REGISTERS ||		    \
+			    fn == _FC_WRITE_AND_READ_REGISTERS ?	    \
 				(MODBUS_MAX_PACKET_LENGTH - 5)/2 :	    \
 			    fn == _FC_WRITE_MULTIPLE_REGISTERS ?	    \
 				(MODBUS_MAX_PACKET_LENGTH - 9)/2 :	    \
+			    fn == _FC_READ_FIFO_QUEUE ?			    \
+				MB_MIN((MODBUS_MAX_PACKET_LENGTH - 8)/2, 31) : \
+			    0)
+
+/* Registers written by a request, which carries the values itself */
+#define MAX_NR_WRITE_REGS(fn) ( fn == _FC_WRITE_MULTIPLE_REGISTERS ?	    \
+				(MODBUS_MAX_PACKET_LENGTH - 9)/2 :	    \
+			    fn == _FC_WRITE_AND_READ_REGISTERS ?	    \
+				(MODBUS_MAX_PACKET_LENGTH - 13)/2 :	    \
+			    0)
+
+#define MAX_NR_COILS(fn) (  fn == _FC_READ_COILS ||			    \
+			    fn == _FC_READ_DISCRETE_INPUTS ?		    \
+				(MODBUS_MAX_PACKET_LENGTH - 5)*8 :	    \
+			    fn == _FC_WRITE_MULTIPLE_COILS ?		    \
+				(MODBUS_MAX_PACKET_LENGTH - 9)*8 :	    \
 			    0)
 			    
 
@@ -84,8 +192,10 @@ static uint8_t mb_val_to_buf(uint8_t *buf, uint16_t val) {
 }
 
 typedef void	(*modbus_write_t)	(const uint8_t *msg, uint8_t bytes);
+typedef uint8_t (*modbus_write_ready_t)	(void);
 typedef uint8_t (*modbus_read_t)	(void);
 typedef uint8_t (*modbus_read_ready_t)	(void);
+/* Returns the number of response bytes, or a negated MODBUS_EXCEPTION_ code */
 typedef int8_t	(*modbus_process_t)	(uint8_t function, uint8_t *msg);
 typedef void	(*modbus_forward_t)	(const uint8_t *msg, uint8_t bytes);
 
@@ -93,17 +203,62 @@ typedef void	(*modbus_forward_t)	(const uint8_t *msg, uint8_t bytes);
 extern void modbus_init(
 	    uint8_t		slave_addr, 
 	    modbus_write_t	modbus_write,
+	    modbus_write_ready_t modbus_write_ready,
 	    modbus_read_ready_t	modbus_read_ready,
-	    modbus_read_t	modbus_read,
-	    modbus_process_t	modbus_process,
-	    modbus_forward_t	modbus_forward);
+	    modbus_read_t	modbus_read);
 #else
 extern void modbus_init(uint8_t slave_addr);
 #endif
 
 extern uint8_t modbus_poll(void);
 
+/* With MODBUS_TX_COMPLETE_CALLBACK set, the port calls modbus_tx_complete()
+ * once each reply has been sent, rather than MODBUS_WRITE_READY_FUNC being
+ * polled. It may be called from an interrupt. */
+#ifndef MODBUS_TX_COMPLETE_CALLBACK
+#define MODBUS_TX_COMPLETE_CALLBACK 0
+#endif
+extern void modbus_tx_complete(void);
+
+/* Write requests to the broadcast address are applied to every unit ID, and
+ * are never answered */
+#define MODBUS_BROADCAST_ADDRESS 0
+extern void modbus_add_slave_addr(uint8_t slave_addr);
+extern void modbus_remove_slave_addr(uint8_t slave_addr);
+
+/* Routes requests for a unit ID to one of MODBUS_FORWARD_PORTS. Requests
+ * routed to MODBUS_ROUTE_NONE are answered with a gateway path exception. */
+#define MODBUS_ROUTE_NONE 0xff
+extern void modbus_route(uint8_t slave_addr, uint8_t port);
+
+/* Each forwarding interface has one request in progress at a time. It ends
+ * when the response has been passed to modbus_port_rx(), which the
+ * application calls with every byte received on the interface, or after
+ * MODBUS_RESPONSE_TIMEOUT_MS. Broadcasts end after MODBUS_TURNAROUND_MS. Both
+ * are counted from when the request is written. Responses whose length
+ * cannot be told from their header end after MODBUS_PORT_SILENCE_MS without
+ * a byte, which must cover the gaps between calls to modbus_port_rx(). */
+#ifndef MODBUS_RESPONSE_TIMEOUT_MS
+#define MODBUS_RESPONSE_TIMEOUT_MS 1000
+#endif
+#ifndef MODBUS_TURNAROUND_MS
+#define MODBUS_TURNAROUND_MS 100
+#endif
+#ifndef MODBUS_PORT_SILENCE_MS
+#define MODBUS_PORT_SILENCE_MS 10
+#endif
+extern void modbus_port_rx(uint8_t port, const uint8_t *data, uint8_t bytes);
+
 #define MODBUS_ACTIVE_HIGH  1
 #define MODBUS_ACTIVE_LOW   0
+#if MODBUS_RS485_DE_CONTROL
+extern void modbus_rs485_put_array(const uint8_t *msg, uint8_t bytes);
+extern uint8_t modbus_rs485_ready(void);
+#ifdef MODBUS_POSIX
+extern int modbus_rs485_fd;
+extern int modbus_rs485_error;
+#endif
+#endif
+
 extern void modbus_tx_led(void (*led_enable)(uint8_t val), uint8_t val);
 extern void modbus_rx_led(void (*led_enable)(uint8_t val), uint8_t val);